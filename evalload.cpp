@@ -0,0 +1,266 @@
+/******************************************************************************
+ * Copyright 2014 Micah C Chambers (micahc.vt@gmail.com)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * @file evalload.cpp Load generator for evalserver. Keeps a number of
+ * requests in flight on each of several connections and reports throughput
+ * and latency percentiles.
+ *
+ *****************************************************************************/
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <unordered_map>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "evalproto.h"
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+/**
+ * @brief Writes all of buf, return error if != 0
+ */
+int writeall(int fd, const void* buf, size_t bytes)
+{
+    const char* p = (const char*)buf;
+    while(bytes > 0) {
+        ssize_t n = send(fd, p, bytes, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        p += n;
+        bytes -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Reads exactly bytes into buf, return error if != 0
+ */
+int readall(int fd, void* buf, size_t bytes)
+{
+    char* p = (char*)buf;
+    while(bytes > 0) {
+        ssize_t n = read(fd, p, bytes);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        p += n;
+        bytes -= n;
+    }
+    return 0;
+}
+
+int connectto(string path)
+{
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path)-1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0 || connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+        if(fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Results of one connection
+ */
+struct Load
+{
+    vector<double> latency; // microseconds
+    size_t rows;
+    size_t errors;
+};
+
+/**
+ * @brief Sends requests on one connection until end, keeping depth of them
+ * in flight.
+ */
+void run(string path, uint16_t expr, uint32_t nargs, uint32_t rows,
+        unsigned depth, Clock::time_point end, Load& load)
+{
+    load.rows = 0;
+    load.errors = 0;
+    int fd = connectto(path);
+    if(fd < 0) {
+        load.errors++;
+        return;
+    }
+
+    // the same request every time, with random arguments
+    vector<char> req(sizeof(EvalRequest) + (size_t)rows*nargs*sizeof(double));
+    double* cols = (double*)(req.data()+sizeof(EvalRequest));
+    for(size_t ii = 0; ii < (size_t)rows*nargs; ii++)
+        cols[ii] = rand()/(double)RAND_MAX-.5;
+    EvalRequest hdr;
+    hdr.op = EVAL_COMPUTE;
+    hdr.expr = expr;
+    hdr.rows = rows;
+    hdr.nargs = nargs;
+
+    uint32_t nextid = 0;
+    unordered_map<uint32_t, Clock::time_point> sent;
+    vector<double> out(rows);
+    auto send = [&]() {
+        hdr.id = nextid++;
+        memcpy(req.data(), &hdr, sizeof(hdr));
+        sent[hdr.id] = Clock::now();
+        return writeall(fd, req.data(), req.size());
+    };
+
+    for(unsigned ii = 0; ii < depth; ii++) {
+        if(send() != 0) {
+            load.errors++;
+            close(fd);
+            return;
+        }
+    }
+
+    // send another request each time a reply comes back, until end
+    while(!sent.empty()) {
+        EvalReply rep;
+        if(readall(fd, &rep, sizeof(rep)) != 0 || rep.count > rows ||
+                readall(fd, out.data(), rep.count*sizeof(double)) != 0) {
+            load.errors++;
+            break;
+        }
+
+        auto it = sent.find(rep.id);
+        if(it == sent.end() || rep.status != EVAL_OK) {
+            load.errors++;
+        } else {
+            auto now = Clock::now();
+            load.latency.push_back(
+                    chrono::duration<double, micro>(now-it->second).count());
+            load.rows += rep.count;
+            sent.erase(it);
+        }
+
+        if(Clock::now() < end && send() != 0) {
+            load.errors++;
+            break;
+        }
+    }
+    close(fd);
+}
+
+int main(int argc, char** argv)
+{
+    if(argc < 3 || argc > 7) {
+        cerr << "Usage: " << argv[0] << " <socket> <expr> [connections] "
+            "[depth] [rows] [seconds]" << endl;
+        return -1;
+    }
+    string path = argv[1];
+    uint16_t expr = atoi(argv[2]);
+    unsigned nconn = argc > 3 ? atoi(argv[3]) : 4;
+    unsigned depth = argc > 4 ? atoi(argv[4]) : 8;
+    uint32_t rows = argc > 5 ? atoi(argv[5]) : 16;
+    double seconds = argc > 6 ? atof(argv[6]) : 5;
+    if(nconn == 0 || depth == 0 || rows == 0 || rows > EVAL_MAXROWS) {
+        cerr << "Bad connections, depth or rows" << endl;
+        return -1;
+    }
+
+    // ask for the arguments of the expression
+    int fd = connectto(path);
+    if(fd < 0) {
+        cerr << "Could not connect to " << path << ": " << strerror(errno)
+            << endl;
+        return -1;
+    }
+    EvalRequest req;
+    memset(&req, 0, sizeof(req));
+    req.op = EVAL_ARGS;
+    req.expr = expr;
+    EvalReply rep;
+    string args;
+    if(writeall(fd, &req, sizeof(req)) != 0 ||
+            readall(fd, &rep, sizeof(rep)) != 0 || rep.status != EVAL_OK ||
+            rep.count > EVAL_MAXARGS) {
+        cerr << "Expression " << expr << " is not available" << endl;
+        close(fd);
+        return -1;
+    }
+    args.resize(rep.count);
+    if(readall(fd, &args[0], rep.count) != 0) {
+        cerr << "Expression " << expr << " is not available" << endl;
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    cerr << "Expression " << expr << ", arguments: " << args << endl;
+    if(args.empty() && rows > EVAL_MAXCONSTROWS) {
+        cerr << "Expressions without arguments take at most "
+            << EVAL_MAXCONSTROWS << " rows" << endl;
+        return -1;
+    }
+
+    auto start = Clock::now();
+    auto end = start + chrono::duration_cast<Clock::duration>(
+            chrono::duration<double>(seconds));
+    vector<Load> loads(nconn);
+    vector<thread> threads;
+    for(unsigned ii = 0; ii < nconn; ii++) {
+        threads.push_back(thread(run, path, expr, (uint32_t)args.size(),
+                    rows, depth, end, ref(loads[ii])));
+    }
+    for(auto& t : threads)
+        t.join();
+    double elapsed = chrono::duration<double>(Clock::now()-start).count();
+
+    vector<double> latency;
+    size_t nrows = 0;
+    size_t errors = 0;
+    for(auto& l : loads) {
+        latency.insert(latency.end(), l.latency.begin(), l.latency.end());
+        nrows += l.rows;
+        errors += l.errors;
+    }
+    sort(latency.begin(), latency.end());
+    auto pct = [&latency](double p) {
+        if(latency.empty())
+            return 0.;
+        return latency[min(latency.size()-1, (size_t)(p*latency.size()))];
+    };
+
+    cerr << "Requests:   " << latency.size() << " (" << errors << " errors)"
+        << endl;
+    cerr << "Throughput: " << latency.size()/elapsed << " requests/s, "
+        << nrows/elapsed << " rows/s" << endl;
+    cerr << "Latency us: p50 " << pct(.5) << ", p90 " << pct(.9) << ", p99 "
+        << pct(.99) << ", p99.9 " << pct(.999) << ", max "
+        << (latency.empty() ? 0 : latency.back()) << endl;
+    return errors == 0 ? 0 : -1;
+}
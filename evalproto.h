@@ -0,0 +1,72 @@
+/******************************************************************************
+ * Copyright 2014 Micah C Chambers (micahc.vt@gmail.com)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * @file evalproto.h Binary protocol between evalserver and its clients over
+ * a Unix domain socket. Both ends are on the same host, so values are in
+ * native byte order.
+ *
+ *****************************************************************************/
+
+#ifndef EVALPROTO_H
+#define EVALPROTO_H
+
+#include <cstdint>
+
+/*
+ * A request is an EvalRequest followed by nargs columns of rows doubles, one
+ * for each argument of the expression in sorted order of the argument names.
+ * EVAL_ARGS requests have no columns. The reply is an EvalReply followed by
+ * count doubles for EVAL_COMPUTE or count argument names (chars) for
+ * EVAL_ARGS. Replies carry the id of their request and may come back in any
+ * order. The server closes the connection on a request whose columns don't
+ * match the arguments of its expression.
+ */
+enum EvalOp : uint16_t
+{
+    EVAL_COMPUTE = 0,
+    EVAL_ARGS = 1
+};
+
+// Status of a reply
+const int32_t EVAL_OK = 0;
+const int32_t EVAL_BADEXPR = -1;
+const int32_t EVAL_BADREQUEST = -2;
+
+// Largest number of rows in one request, and of arguments of an expression
+// (they are single letters)
+const uint32_t EVAL_MAXROWS = 1 << 20;
+const uint32_t EVAL_MAXARGS = 52;
+
+// Largest number of rows of an EVAL_COMPUTE request for an expression without
+// arguments, since its reply is so much bigger than the request
+const uint32_t EVAL_MAXCONSTROWS = 1 << 10;
+
+struct EvalRequest
+{
+    uint32_t id;
+    uint16_t op;
+    uint16_t expr;
+    uint32_t rows;
+    uint32_t nargs;
+};
+
+struct EvalReply
+{
+    uint32_t id;
+    int32_t status;
+    uint32_t count;
+};
+
+#endif // EVALPROTO_H
@@ -0,0 +1,563 @@
+/******************************************************************************
+ * Copyright 2014 Micah C Chambers (micahc.vt@gmail.com)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * @file evalserver.cpp Daemon that holds a catalog of compiled expressions
+ * and evaluates requests from a Unix domain socket. Small requests for the
+ * same expression are coalesced into batches, which are computed when they
+ * are big enough or when their oldest request reaches a deadline.
+ *
+ *****************************************************************************/
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <algorithm>
+#include <unordered_map>
+#include <cstring>
+#include <cstdlib>
+#include <csignal>
+#include <cerrno>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "mathexpression.h"
+#include "evalproto.h"
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+// Bytes of replies a connection may have queued or owed before the server
+// stops reading its requests
+const size_t MAXBACKLOG = 16 << 20;
+
+/**
+ * @brief A client connection, with bytes that are not parsed or not sent yet.
+ * owed is the size of the replies to its requests still waiting in batches.
+ */
+struct Conn
+{
+    int fd;
+    bool closed;
+    bool reading;
+    bool writing;
+    vector<char> in;
+    size_t inoff;
+    vector<char> out;
+    size_t outoff;
+    size_t owed;
+};
+
+/**
+ * @brief Request waiting in a batch, its rows start at row off of the batch
+ */
+struct Pending
+{
+    shared_ptr<Conn> conn;
+    uint32_t id;
+    uint32_t rows;
+    size_t off;
+};
+
+/**
+ * @brief An expression of the catalog and the requests waiting for it
+ */
+struct Batch
+{
+    shared_ptr<MathExpression> expr;
+    string args;
+    vector<vector<double>> cols;
+    vector<double> out;
+    vector<Pending> pending;
+    size_t rows;
+    Clock::time_point deadline;
+};
+
+volatile sig_atomic_t g_stop = 0;
+int g_epoll = -1;
+
+size_t g_requests = 0;
+size_t g_batches = 0;
+size_t g_rows = 0;
+
+void onsignal(int)
+{
+    g_stop = 1;
+}
+
+/**
+ * @brief Bytes of replies that the connection has not received yet
+ */
+size_t backlog(const shared_ptr<Conn>& conn)
+{
+    return conn->out.size()-conn->outoff + conn->owed;
+}
+
+/**
+ * @brief Waits for EPOLLOUT while there is output left, and for EPOLLIN only
+ * while the client keeps up with its replies.
+ */
+void watch(shared_ptr<Conn>& conn)
+{
+    bool reading = backlog(conn) < MAXBACKLOG;
+    bool writing = !conn->out.empty();
+    if(reading != conn->reading || writing != conn->writing) {
+        epoll_event ev;
+        ev.events = (reading ? (uint32_t)EPOLLIN : 0u) |
+            (writing ? (uint32_t)EPOLLOUT : 0u);
+        ev.data.fd = conn->fd;
+        epoll_ctl(g_epoll, EPOLL_CTL_MOD, conn->fd, &ev);
+        conn->reading = reading;
+        conn->writing = writing;
+    }
+}
+
+/**
+ * @brief Sends as much of the connection's output as the socket takes, then
+ * updates what to wait for.
+ */
+void sendout(shared_ptr<Conn>& conn)
+{
+    while(conn->outoff < conn->out.size()) {
+        ssize_t n = send(conn->fd, conn->out.data()+conn->outoff,
+                conn->out.size()-conn->outoff, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if(n <= 0) {
+            conn->closed = true;
+            return;
+        }
+        conn->outoff += n;
+    }
+
+    // drop what was sent once it is more than what is left, so that the
+    // buffer doesn't keep growing while the client reads as fast as replies
+    // are queued
+    if(conn->outoff == conn->out.size()) {
+        conn->out.clear();
+        conn->outoff = 0;
+    } else if(conn->outoff > conn->out.size()-conn->outoff) {
+        conn->out.erase(conn->out.begin(), conn->out.begin()+conn->outoff);
+        conn->outoff = 0;
+    }
+
+    watch(conn);
+}
+
+/**
+ * @brief Appends a reply to the connection's output
+ */
+void reply(shared_ptr<Conn>& conn, uint32_t id, int32_t status,
+        uint32_t count, const void* data, size_t bytes)
+{
+    EvalReply rep;
+    rep.id = id;
+    rep.status = status;
+    rep.count = count;
+    const char* p = (const char*)&rep;
+    conn->out.insert(conn->out.end(), p, p+sizeof(rep));
+    p = (const char*)data;
+    conn->out.insert(conn->out.end(), p, p+bytes);
+}
+
+/**
+ * @brief Computes all the requests waiting in a batch and queues the replies
+ */
+void flush(Batch& batch, vector<shared_ptr<Conn>>& touched)
+{
+    if(batch.pending.empty())
+        return;
+
+    for(size_t ii = 0; ii < batch.args.size(); ii++)
+        batch.expr->setcolumn(batch.args[ii], batch.cols[ii].data());
+    batch.out.resize(batch.rows);
+    batch.expr->exec(batch.rows, batch.out.data());
+
+    for(auto& p : batch.pending) {
+        p.conn->owed -= sizeof(EvalReply) + p.rows*sizeof(double);
+        if(p.conn->closed)
+            continue;
+        reply(p.conn, p.id, EVAL_OK, p.rows, batch.out.data()+p.off,
+                p.rows*sizeof(double));
+        touched.push_back(p.conn);
+    }
+
+    g_batches++;
+    g_rows += batch.rows;
+    batch.pending.clear();
+    batch.rows = 0;
+    for(auto& c : batch.cols)
+        c.clear();
+}
+
+/**
+ * @brief Parses the complete requests from a connection, adding them to the
+ * batches. Each header is checked against the catalog before waiting for its
+ * columns, so at most one valid request is ever left buffered. Stops while
+ * the connection's backlog of replies is over MAXBACKLOG, leaving the rest
+ * buffered.
+ *
+ * @return error if != 0, the connection can't be trusted and should close
+ */
+int parse(shared_ptr<Conn>& conn, vector<Batch>& catalog,
+        Clock::duration deadline, size_t batchrows,
+        vector<shared_ptr<Conn>>& touched)
+{
+    while(conn->in.size()-conn->inoff >= sizeof(EvalRequest) &&
+            backlog(conn) < MAXBACKLOG) {
+        EvalRequest req;
+        memcpy(&req, conn->in.data()+conn->inoff, sizeof(req));
+        if(req.rows > EVAL_MAXROWS || req.nargs > EVAL_MAXARGS)
+            return -1;
+
+        // Requests without columns get an error reply, but columns that
+        // don't match the expression mean the client is out of step
+        bool known = req.expr < catalog.size() && catalog[req.expr].expr;
+        bool hascols = req.rows > 0 && req.nargs > 0;
+        if(req.op == EVAL_COMPUTE && known) {
+            if(req.nargs != catalog[req.expr].args.size() ||
+                    (req.nargs == 0 && req.rows > EVAL_MAXCONSTROWS))
+                return -1;
+        } else if(hascols) {
+            return -1;
+        }
+
+        size_t bytes = sizeof(req) + (size_t)req.rows*req.nargs*sizeof(double);
+        if(conn->in.size()-conn->inoff < bytes)
+            break;
+        const char* cols = conn->in.data()+conn->inoff+sizeof(req);
+        conn->inoff += bytes;
+        g_requests++;
+
+        if(!known) {
+            reply(conn, req.id, EVAL_BADEXPR, 0, NULL, 0);
+            touched.push_back(conn);
+            continue;
+        }
+
+        Batch& batch = catalog[req.expr];
+        if(req.op == EVAL_ARGS) {
+            reply(conn, req.id, EVAL_OK, batch.args.size(),
+                    batch.args.data(), batch.args.size());
+            touched.push_back(conn);
+            continue;
+        } else if(req.op != EVAL_COMPUTE) {
+            reply(conn, req.id, EVAL_BADREQUEST, 0, NULL, 0);
+            touched.push_back(conn);
+            continue;
+        }
+
+        // the deadline is set by the oldest request in the batch
+        if(batch.pending.empty())
+            batch.deadline = Clock::now() + deadline;
+
+        Pending p;
+        p.conn = conn;
+        p.id = req.id;
+        p.rows = req.rows;
+        p.off = batch.rows;
+        batch.pending.push_back(p);
+        batch.rows += req.rows;
+        conn->owed += sizeof(EvalReply) + req.rows*sizeof(double);
+        for(size_t ii = 0; ii < req.nargs; ii++) {
+            batch.cols[ii].resize(p.off+req.rows);
+            memcpy(batch.cols[ii].data()+p.off,
+                    cols+ii*req.rows*sizeof(double), req.rows*sizeof(double));
+        }
+
+        if(batch.rows >= batchrows)
+            flush(batch, touched);
+    }
+
+    // drop the parsed bytes
+    conn->in.erase(conn->in.begin(), conn->in.begin()+conn->inoff);
+    conn->inoff = 0;
+    return 0;
+}
+
+/**
+ * @brief Reads the expression catalog, one expression per line. The line
+ * number (from 0) is the expression number used in requests.
+ *
+ * @return error if != 0 (the file could not be read)
+ */
+int loadcatalog(string path, vector<Batch>& catalog)
+{
+    vector<string> eqs;
+    ifstream fin(path);
+    if(!fin.is_open()) {
+        cerr << "Could not open catalog " << path << ": " << strerror(errno)
+            << endl;
+        return -1;
+    }
+    string line;
+    while(getline(fin, line))
+        eqs.push_back(line);
+    if(fin.bad()) {
+        cerr << "Could not read catalog " << path << endl;
+        return -1;
+    }
+
+    CompileStats stats;
+    auto compiled = MathExpression::compile_all(eqs, 0, &stats);
+    cerr << "Compiled " << eqs.size()-stats.failed << " of " << eqs.size()
+        << " expressions in " << stats.total << "s" << endl;
+
+    catalog.assign(eqs.size(), Batch());
+    for(size_t ii = 0; ii < eqs.size(); ii++) {
+        Batch& batch = catalog[ii];
+        batch.rows = 0;
+        batch.expr = compiled[ii].expr;
+        if(!batch.expr) {
+            cerr << ii << ": " << compiled[ii].error << " at "
+                << compiled[ii].pos << endl;
+            continue;
+        }
+
+        for(auto it = batch.expr->begin(); it != batch.expr->end(); ++it)
+            batch.args += it->first;
+        sort(batch.args.begin(), batch.args.end());
+        batch.cols.resize(batch.args.size());
+    }
+
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    if(argc < 3 || argc > 5) {
+        cerr << "Usage: " << argv[0] << " <socket> <catalog> [deadline_us] "
+            "[batch_rows]" << endl;
+        cerr << "Catalog is a file with one expression per line" << endl;
+        return -1;
+    }
+    string path = argv[1];
+    Clock::duration deadline = chrono::microseconds(
+            argc > 3 ? atol(argv[3]) : 200);
+    size_t batchrows = argc > 4 ? atol(argv[4]) : 1024;
+
+    vector<Batch> catalog;
+    if(loadcatalog(argv[2], catalog) != 0)
+        return -1;
+
+    // largest request that the catalog accepts, a connection never buffers
+    // more than that and one read
+    size_t maxargs = 0;
+    for(auto& batch : catalog)
+        maxargs = max(maxargs, batch.args.size());
+    size_t maxrequest = sizeof(EvalRequest) +
+        (size_t)EVAL_MAXROWS*maxargs*sizeof(double);
+
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(path.size() >= sizeof(addr.sun_path)) {
+        cerr << "Socket path too long" << endl;
+        return -1;
+    }
+    strcpy(addr.sun_path, path.c_str());
+
+    // only replace a stale socket, never some other file at that path
+    struct stat st;
+    if(lstat(path.c_str(), &st) == 0) {
+        if(!S_ISSOCK(st.st_mode)) {
+            cerr << path << " exists and is not a socket" << endl;
+            return -1;
+        }
+        unlink(path.c_str());
+    } else if(errno != ENOENT) {
+        cerr << "Could not stat " << path << ": " << strerror(errno) << endl;
+        return -1;
+    }
+
+    int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(lfd < 0 || bind(lfd, (sockaddr*)&addr, sizeof(addr)) != 0 ||
+            listen(lfd, 128) != 0) {
+        cerr << "Could not listen on " << path << ": " << strerror(errno)
+            << endl;
+        return -1;
+    }
+
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    g_epoll = epoll_create1(EPOLL_CLOEXEC);
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = lfd;
+    epoll_ctl(g_epoll, EPOLL_CTL_ADD, lfd, &ev);
+    ev.data.fd = tfd;
+    epoll_ctl(g_epoll, EPOLL_CTL_ADD, tfd, &ev);
+
+    signal(SIGINT, onsignal);
+    signal(SIGTERM, onsignal);
+    cerr << "Listening on " << path << endl;
+
+    unordered_map<int, shared_ptr<Conn>> conns;
+    vector<shared_ptr<Conn>> touched;
+    const int MAXEVENTS = 64;
+    epoll_event events[MAXEVENTS];
+    vector<char> buf(1 << 16);
+    while(!g_stop) {
+        // wake up for the earliest deadline, the timer is in nanoseconds
+        // where epoll_wait is in milliseconds
+        Clock::time_point next = Clock::time_point::max();
+        for(auto& batch : catalog) {
+            if(!batch.pending.empty())
+                next = min(next, batch.deadline);
+        }
+        itimerspec its;
+        memset(&its, 0, sizeof(its));
+        if(next != Clock::time_point::max()) {
+            auto ns = chrono::duration_cast<chrono::nanoseconds>(
+                    next-Clock::now()).count();
+            ns = max<long long>(ns, 1);
+            its.it_value.tv_sec = ns/1000000000;
+            its.it_value.tv_nsec = ns%1000000000;
+        }
+        timerfd_settime(tfd, 0, &its, NULL);
+
+        int nev = epoll_wait(g_epoll, events, MAXEVENTS, -1);
+        if(nev < 0 && errno != EINTR) {
+            cerr << "epoll_wait: " << strerror(errno) << endl;
+            break;
+        }
+
+        for(int ee = 0; ee < nev; ee++) {
+            int fd = events[ee].data.fd;
+            if(fd == lfd) {
+                int cfd;
+                while((cfd = accept4(lfd, NULL, NULL,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    shared_ptr<Conn> conn(new Conn());
+                    conn->fd = cfd;
+                    conn->closed = false;
+                    conn->reading = true;
+                    conn->writing = false;
+                    conn->inoff = 0;
+                    conn->outoff = 0;
+                    conn->owed = 0;
+                    conns[cfd] = conn;
+                    ev.events = EPOLLIN;
+                    ev.data.fd = cfd;
+                    epoll_ctl(g_epoll, EPOLL_CTL_ADD, cfd, &ev);
+                }
+                continue;
+            } else if(fd == tfd) {
+                uint64_t expired;
+                if(read(tfd, &expired, sizeof(expired)) < 0) {
+                    // nothing to do, the deadlines are checked below
+                }
+                continue;
+            }
+
+            auto it = conns.find(fd);
+            if(it == conns.end())
+                continue;
+            shared_ptr<Conn> conn = it->second;
+
+            // sent below along with the new replies
+            if(events[ee].events & EPOLLOUT)
+                touched.push_back(conn);
+
+            if(events[ee].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                // a client that hung up while held back can't read its
+                // replies anyway
+                if(backlog(conn) >= MAXBACKLOG &&
+                        (events[ee].events & (EPOLLHUP | EPOLLERR)))
+                    conn->closed = true;
+
+                // parse as we go, so that only a partial request is kept,
+                // and stop reading while the replies are backed up
+                while(!conn->closed && backlog(conn) < MAXBACKLOG) {
+                    if(parse(conn, catalog, deadline, batchrows, touched) != 0
+                            || conn->in.size() > maxrequest+buf.size()) {
+                        conn->closed = true;
+                        break;
+                    }
+                    if(backlog(conn) >= MAXBACKLOG)
+                        break;
+
+                    ssize_t n = read(fd, buf.data(), buf.size());
+                    if(n < 0 && errno == EINTR)
+                        continue;
+                    if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                        break;
+                    if(n <= 0) {
+                        conn->closed = true;
+                        break;
+                    }
+                    conn->in.insert(conn->in.end(), buf.data(), buf.data()+n);
+                }
+                if(!conn->closed)
+                    watch(conn);
+            }
+
+            if(conn->closed) {
+                epoll_ctl(g_epoll, EPOLL_CTL_DEL, fd, NULL);
+                close(fd);
+                conns.erase(fd);
+            }
+        }
+
+        // compute the batches that reached their deadline
+        auto now = Clock::now();
+        for(auto& batch : catalog) {
+            if(!batch.pending.empty() && batch.deadline <= now)
+                flush(batch, touched);
+        }
+
+        // send replies together. A connection whose replies drain below
+        // MAXBACKLOG goes on with the requests it has buffered, which can
+        // queue more replies, so repeat until there are none
+        while(!touched.empty()) {
+            vector<shared_ptr<Conn>> sending;
+            sending.swap(touched);
+            for(auto& conn : sending) {
+                if(!conn->closed)
+                    sendout(conn);
+                if(!conn->closed && !conn->in.empty() &&
+                        backlog(conn) < MAXBACKLOG) {
+                    if(parse(conn, catalog, deadline, batchrows, touched) != 0)
+                        conn->closed = true;
+                    else
+                        watch(conn);
+                }
+                if(conn->closed && conns.count(conn->fd) &&
+                        conns[conn->fd] == conn) {
+                    epoll_ctl(g_epoll, EPOLL_CTL_DEL, conn->fd, NULL);
+                    close(conn->fd);
+                    conns.erase(conn->fd);
+                }
+            }
+        }
+    }
+
+    cerr << "Served " << g_requests << " requests, " << g_rows << " rows in "
+        << g_batches << " batches" << endl;
+    close(lfd);
+    close(tfd);
+    close(g_epoll);
+    unlink(path.c_str());
+    return 0;
+}
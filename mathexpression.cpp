@@ -29,14 +29,33 @@
 #include <cstdlib>
 #include <list>
 #include <cassert>
+#include <cstdint>
+#include <iterator>
 #include <random>
 #include <memory>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
 
 #include <stdexcept>
 
 #define INVALID_ARGUMENT(EXP) \
 std::invalid_argument(__PRETTY_FUNCTION__+std::string(" -> ")+std::string(EXP))
 
+// Parse errors are returned rather than thrown, so that the library can be
+// built with -fno-exceptions. The message is for users, the offset is kept
+// separately in errorpos()
+#define PARSE_ERROR(EXP, POS) fail(std::string(EXP), POS)
+
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS)
+#define HAVE_EXCEPTIONS 1
+#define THROW(EXC) throw EXC
+#else
+#define THROW(EXC) abort()
+#endif
+
 std::default_random_engine rng;
 
 using namespace std;
@@ -45,7 +64,12 @@ using namespace std;
 unordered_map<string,int> PRIORITY({{"exp", 5}, {"cos", 5}, {"sin", 5}, {"tan",
         5}, {"log", 5}, {"+", 3}, {"-",3}, {"*", 4}, {"/", 4}, {"==", 2}, {"^",
         6}, {"neg", 7}, {"<=", 2}, {">=", 2}, {"<", 2}, {">", 2}, {"|", 1},
-		{"&", 1}, {"ceil", 5}, {"abs", 5}, {"round", 5}, {"floor", 5}});
+		{"&", 1}, {"ceil", 5}, {"abs", 5}, {"round", 5}, {"floor", 5},
+        {"?", 0}, {":", 0}});
+
+// Conditional, c ? a : b in infix, c a b ? in RPN. Only the taken branch is
+// computed.
+const string TERNARY = "?";
 
 unordered_map<string,function<double(double)>> UNARY({
         {"exp",pointer_to_unary_function<double,double>(exp)},
@@ -74,6 +98,131 @@ unordered_map<string,function<double(double,double)>> BINARY({
         {"|",std::logical_or<double>()}
         });
 
+/*
+ * Batch versions of the operators. These work on a block of rows at a time,
+ * unary in place and binary with the result written over the left hand side,
+ * so that the loops are simple enough for the compiler to vectorize. & and |
+ * are missing because they short-circuit, see the constructor.
+ *
+ * When check is true they also return whether any result was not finite,
+ * tested in the same loop: r-r is 0 for finite r and NaN otherwise.
+ */
+const size_t BLOCKSIZE = 256;
+
+template <typename F>
+function<bool(size_t,double*,bool)> blockunary(F f)
+{
+    return [f](size_t n, double* x, bool check) {
+        if(!check) {
+            for(size_t ii=0; ii<n; ii++)
+                x[ii] = f(x[ii]);
+            return false;
+        }
+
+        int bad = 0;
+        for(size_t ii=0; ii<n; ii++) {
+            double r = f(x[ii]);
+            x[ii] = r;
+            bad |= (r-r != 0);
+        }
+        return bad != 0;
+    };
+}
+
+template <typename F>
+function<bool(size_t,double*,const double*,bool)> blockbinary(F f)
+{
+    return [f](size_t n, double* lhs, const double* rhs, bool check) {
+        if(!check) {
+            for(size_t ii=0; ii<n; ii++)
+                lhs[ii] = f(lhs[ii], rhs[ii]);
+            return false;
+        }
+
+        int bad = 0;
+        for(size_t ii=0; ii<n; ii++) {
+            double r = f(lhs[ii], rhs[ii]);
+            lhs[ii] = r;
+            bad |= (r-r != 0);
+        }
+        return bad != 0;
+    };
+}
+
+unordered_map<string,function<bool(size_t,double*,bool)>> UNARY_BLOCK({
+        {"exp",blockunary([](double v) { return exp(v); })},
+        {"cos",blockunary([](double v) { return cos(v); })},
+        {"sin",blockunary([](double v) { return sin(v); })},
+        {"tan",blockunary([](double v) { return tan(v); })},
+        {"neg",blockunary(std::negate<double>())},
+        {"abs",blockunary([](double v) { return fabs(v); })},
+        {"round",blockunary([](double v) { return round(v); })},
+        {"floor",blockunary([](double v) { return floor(v); })},
+        {"ceil",blockunary([](double v) { return ceil(v); })},
+        {"log",blockunary([](double v) { return log(v); })}});
+
+unordered_map<string,function<bool(size_t,double*,const double*,bool)>> BINARY_BLOCK({
+        {"+",blockbinary(std::plus<double>())},
+        {"-",blockbinary(std::minus<double>())},
+        {"*",blockbinary(std::multiplies<double>())},
+        {"/",blockbinary(std::divides<double>())},
+        {"==",blockbinary(std::equal_to<double>())},
+        {"<", blockbinary(std::less<double>())},
+        {">",blockbinary(std::greater<double>())},
+        {"<=", blockbinary(std::less_equal<double>())},
+        {">=",blockbinary(std::greater_equal<double>())},
+        {"^",blockbinary([](double a, double b) { return pow(a, b); })}
+        });
+
+/*
+ * Anomaly tracking for the batch exec(). The kernels report whether a block
+ * had a non-finite value, and only then markbad() records, for each row, the
+ * index of the first token that produced one. firstbad is -1 for rows that
+ * are not marked, and marked says whether any row of the block is.
+ */
+struct BlockAnomalies
+{
+    bool check;
+    bool marked;
+    vector<long> firstbad;
+};
+
+void markbad(BlockAnomalies& st, long tok, size_t n, const double* x)
+{
+    for(size_t ii=0; ii<n; ii++) {
+        if(x[ii]-x[ii] != 0 && st.firstbad[ii] < 0)
+            st.firstbad[ii] = tok;
+    }
+    st.marked = true;
+}
+
+// Forget anomalies from tokens first up to last in the rows where
+// (c != 0) != taken, which computed a branch they did not take
+void unmarkbad(BlockAnomalies& st, long first, long last, size_t n,
+        const double* c, bool taken)
+{
+    if(!st.marked)
+        return;
+
+    for(size_t ii=0; ii<n; ii++) {
+        if((c[ii] != 0) != taken && st.firstbad[ii] >= first &&
+                st.firstbad[ii] < last)
+            st.firstbad[ii] = -1;
+    }
+}
+
+/**
+ * @brief Priority of an operator, 0 for anything else. Unlike
+ * PRIORITY[tok] this never inserts, so it is safe from multiple threads.
+ */
+int priority(const string& tok)
+{
+    auto it = PRIORITY.find(tok);
+    if(it == PRIORITY.end())
+        return 0;
+    return it->second;
+}
+
 void listops()
 {
     cerr << '\t' << left << setw(6) << "Op" << setw(10) << "Priority" << endl;
@@ -84,34 +233,302 @@ void listops()
 }
 
 /**
- * @brief Constructor.
+ * @brief Constructor. Throws ParseError if eq can't be parsed; when building
+ * without exceptions a failed parse is only visible through error(), and the
+ * expression is left empty.
  *
  * @param eq String represntation of equation. Infix format unless rpn is
  * true
  * @param rpn if true, then the equation is assumed to be
  * Reverse-Polish-Notation
  */
-MathExpression::MathExpression(string eq, bool rpn)
+MathExpression::MathExpression(string eq, bool rpn) :
+    m_anomalies(new BlockAnomalies()), m_errorpos(0)
 {
-    auto tokens = tokenize(eq);
-    if(rpn)
-        m_rpn = tokens;
-    else
-        m_rpn = infixreorder(tokens);
+    // without exceptions the error is left in error()
+    if(compile(eq, rpn) != 0) {
+#ifdef HAVE_EXCEPTIONS
+        throw ParseError(m_error, m_errorpos);
+#endif
+    }
+}
 
-    args.clear();
+/**
+ * @brief Empty expression, use compile() to fill it in
+ */
+MathExpression::MathExpression() : m_anomalies(new BlockAnomalies()),
+    m_errorpos(0)
+{
+}
+
+/**
+ * @brief Parses and compiles eq into this expression without throwing, for
+ * use when building with -fno-exceptions.
+ *
+ * @param eq String represntation of equation. Infix format unless rpn is
+ * true
+ * @param rpn if true, then the equation is assumed to be
+ * Reverse-Polish-Notation
+ *
+ * @return error if != 0, see error() and errorpos()
+ */
+int MathExpression::compile(string eq, bool rpn)
+{
+    m_error.clear();
+    m_errorpos = 0;
+
+    list<string> tokens;
+    list<size_t> pos;
+    if(tokenize(eq, tokens, pos) != 0)
+        return -1;
+    if(!rpn && infixreorder(tokens, pos) != 0)
+        return -1;
+
+    return build(tokens, pos);
+}
+
+/**
+ * @brief Records an error for error() and errorpos()
+ *
+ * @return -1, so that it can be returned
+ */
+int MathExpression::fail(string msg, size_t pos)
+{
+    m_error = msg;
+    m_errorpos = pos;
+    return -1;
+}
+
+/**
+ * @brief Parses and compiles many expressions in parallel. Errors are
+ * returned for each expression rather than thrown, so a bad expression does
+ * not stop the others.
+ *
+ * @param eqs Equations to compile
+ * @param threads Number of threads to use, 0 for the hardware concurrency
+ * @param stats If not NULL, filled with the time spent in each stage
+ * @param rpn if true, then the equations are assumed to be
+ * Reverse-Polish-Notation
+ *
+ * @return One result for each equation, in the same order
+ */
+vector<CompileResult> MathExpression::compile_all(const vector<string>& eqs,
+        unsigned threads, CompileStats* stats, bool rpn)
+{
+    typedef chrono::steady_clock clock;
+    auto seconds = [](clock::time_point a, clock::time_point b) {
+        return chrono::duration<double>(b-a).count();
+    };
+
+    auto start = clock::now();
+    vector<CompileResult> out(eqs.size());
+    if(threads == 0)
+        threads = max(thread::hardware_concurrency(), 1u);
+    threads = max(min<size_t>(threads, eqs.size()), (size_t)1);
+
+    // Each thread takes the next expression, and keeps its own timings
+    atomic<size_t> next(0);
+    vector<CompileStats> tstats(threads, CompileStats());
+    auto worker = [&](unsigned tt) {
+        CompileStats& ts = tstats[tt];
+        for(size_t ii = next++; ii < eqs.size(); ii = next++) {
+            CompileResult& res = out[ii];
+            shared_ptr<MathExpression> expr(new MathExpression());
+            list<string> tokens;
+            list<size_t> pos;
+
+            auto t0 = clock::now();
+            int err = expr->tokenize(eqs[ii], tokens, pos);
+            auto t1 = clock::now();
+            if(!err && !rpn)
+                err = expr->infixreorder(tokens, pos);
+            auto t2 = clock::now();
+            if(!err)
+                err = expr->build(tokens, pos);
+            auto t3 = clock::now();
+
+            ts.tokenize += seconds(t0, t1);
+            ts.reorder += seconds(t1, t2);
+            ts.build += seconds(t2, t3);
+            res.pos = expr->m_errorpos;
+            if(err) {
+                res.error = expr->m_error;
+                ts.failed++;
+            } else {
+                res.expr = expr;
+            }
+        }
+    };
+
+    vector<thread> pool;
+    for(unsigned tt = 1; tt < threads; tt++)
+        pool.push_back(thread(worker, tt));
+    worker(0);
+    for(auto& t : pool)
+        t.join();
+
+    if(stats) {
+        *stats = CompileStats();
+        for(auto& ts : tstats) {
+            stats->tokenize += ts.tokenize;
+            stats->reorder += ts.reorder;
+            stats->build += ts.build;
+            stats->failed += ts.failed;
+        }
+        stats->total = seconds(start, clock::now());
+    }
+
+    return out;
+}
+
+/**
+ * @brief Helper function that builds the executors from an expression in
+ * RPN. Everything is built into locals and only swapped into the object on
+ * success, so a failed compile() leaves the previous expression working.
+ *
+ * @param rpn Tokens in RPN, moved into m_rpn on success
+ * @param pos Offset of each token, moved into m_rpnpos on success
+ *
+ * @return error if != 0
+ */
+int MathExpression::build(list<string>& rpn, list<size_t>& pos)
+{
+    unordered_map<string, shared_ptr<double>> newargs;
+    unordered_map<string, shared_ptr<const double*>> newcolumns;
+    shared_ptr<BlockAnomalies> anomalies(new BlockAnomalies());
+    anomalies->check = false;
+    anomalies->marked = false;
     function<double()> lhs;
     function<double()> rhs;
+    function<void(size_t,size_t,double*)> blhs;
+    function<void(size_t,size_t,double*)> brhs;
     pair<unordered_map<string,shared_ptr<double>>::iterator, bool> inserted;
 
+    // stack holds the scalar functions, bstack the matching block functions
+    // and starts the index of the first token of each, so that the tokens
+    // of a branch are starts[branch] up to the start of the next one
     list<function<double()>> stack;
-    for(auto it = m_rpn.begin(); it != m_rpn.end(); it++) {
+    list<function<void(size_t,size_t,double*)>> bstack;
+    list<long> starts;
+    long idx = 0;
+    auto pit = pos.begin();
+    for(auto it = rpn.begin(); it != rpn.end(); it++, pit++, idx++) {
         string tok = *it;
-        if(BINARY.count(tok))  {
+        if(tok == TERNARY) {
+            if(stack.size() < 3)
+                return PARSE_ERROR("Not Enough Arguments!", *pit);
+
+            // false branch, true branch, then condition
+            rhs = stack.back();
+            stack.pop_back();
+            lhs = stack.back();
+            stack.pop_back();
+            auto cond = stack.back();
+            stack.pop_back();
+
+            stack.push_back(
+                    [cond, lhs, rhs](){
+                    return cond() != 0 ? lhs() : rhs();
+                    });
+
+            brhs = bstack.back();
+            bstack.pop_back();
+            blhs = bstack.back();
+            bstack.pop_back();
+            auto bcond = bstack.back();
+            bstack.pop_back();
+
+            long fstart = starts.back();
+            starts.pop_back();
+            long tstart = starts.back();
+            starts.pop_back();
+
+            // Only compute a branch if some row in the block takes it, blend
+            // when the block is mixed and forget anomalies from the rows of
+            // each branch that were not taken
+            shared_ptr<vector<double>> ctmp(new vector<double>(BLOCKSIZE));
+            shared_ptr<vector<double>> ltmp(new vector<double>(BLOCKSIZE));
+            bstack.push_back(
+                    [bcond, blhs, brhs, ctmp, ltmp, anomalies, tstart, fstart,
+                    idx](size_t off, size_t n, double* out){
+                    double* c = ctmp->data();
+                    bcond(off, n, c);
+                    size_t ntrue = 0;
+                    for(size_t ii=0; ii<n; ii++)
+                        ntrue += (c[ii] != 0);
+
+                    if(ntrue == n) {
+                        blhs(off, n, out);
+                    } else if(ntrue == 0) {
+                        brhs(off, n, out);
+                    } else {
+                        double* l = ltmp->data();
+                        blhs(off, n, l);
+                        unmarkbad(*anomalies, tstart, fstart, n, c, true);
+                        brhs(off, n, out);
+                        unmarkbad(*anomalies, fstart, idx, n, c, false);
+                        for(size_t ii=0; ii<n; ii++)
+                            out[ii] = c[ii] != 0 ? l[ii] : out[ii];
+                    }
+                    });
+
+        } else if(tok == "&" || tok == "|") {
+            // short-circuiting logical operators
+            if(stack.size() < 2)
+                return PARSE_ERROR("Not Enough Arguments!", *pit);
+
+            rhs = stack.back();
+            stack.pop_back();
+            lhs = stack.back();
+            stack.pop_back();
+
+            brhs = bstack.back();
+            bstack.pop_back();
+            blhs = bstack.back();
+            bstack.pop_back();
+
+            long rstart = starts.back();
+            starts.pop_back();
+
+            // & is decided when lhs is 0, | when lhs is non-zero
+            bool isand = (tok == "&");
+            if(isand)
+                stack.push_back([lhs, rhs](){ return lhs() != 0 && rhs() != 0; });
+            else
+                stack.push_back([lhs, rhs](){ return lhs() != 0 || rhs() != 0; });
+
+            shared_ptr<vector<double>> rtmp(new vector<double>(BLOCKSIZE));
+            bstack.push_back(
+                    [blhs, brhs, rtmp, isand, anomalies, rstart, idx](
+                        size_t off, size_t n, double* out){
+                    blhs(off, n, out);
+                    size_t ndecided = 0;
+                    for(size_t ii=0; ii<n; ii++) {
+                        out[ii] = (out[ii] != 0);
+                        ndecided += (out[ii] != isand);
+                    }
+
+                    // skip rhs if every row is already decided
+                    if(ndecided == n)
+                        return;
+
+                    double* r = rtmp->data();
+                    brhs(off, n, r);
+                    unmarkbad(*anomalies, rstart, idx, n, out, isand);
+                    if(isand) {
+                        for(size_t ii=0; ii<n; ii++)
+                            out[ii] = (out[ii] != 0 && r[ii] != 0);
+                    } else {
+                        for(size_t ii=0; ii<n; ii++)
+                            out[ii] = (out[ii] != 0 || r[ii] != 0);
+                    }
+                    });
+
+        } else if(BINARY.count(tok))  {
 
             // pull out left and right hand sides
             if(stack.size() < 2)
-                throw INVALID_ARGUMENT("Not Enough Arguments!");
+                return PARSE_ERROR("Not Enough Arguments!", *pit);
 
             // RHS
             rhs = stack.back();
@@ -132,10 +549,30 @@ MathExpression::MathExpression(string eq, bool rpn)
                     return BINARY[tok](lhsv, rhsv);
                     });
 
+            // Block version, lhs is computed into the output and rhs into
+            // a temporary
+            brhs = bstack.back();
+            bstack.pop_back();
+            blhs = bstack.back();
+            bstack.pop_back();
+            starts.pop_back();
+
+            auto kernel = BINARY_BLOCK.at(tok);
+            shared_ptr<vector<double>> rtmp(new vector<double>(BLOCKSIZE));
+            bstack.push_back(
+                    [blhs, brhs, kernel, rtmp, anomalies, idx](size_t off,
+                        size_t n, double* out){
+                    double* r = rtmp->data();
+                    blhs(off, n, out);
+                    brhs(off, n, r);
+                    if(kernel(n, out, r, anomalies->check))
+                        markbad(*anomalies, idx, n, out);
+                    });
+
         } else if(UNARY.count(tok)) {
             // pull out left and right hand sides
             if(stack.size() < 1)
-                throw INVALID_ARGUMENT("Not Enough Arguments!");
+                return PARSE_ERROR("Not Enough Arguments!", *pit);
 
             // LHS
             auto lhs = stack.back();
@@ -151,6 +588,19 @@ MathExpression::MathExpression(string eq, bool rpn)
                     return UNARY[tok](lhsv);
                     });
 
+            auto blhs = bstack.back();
+            bstack.pop_back();
+            auto kernel = UNARY_BLOCK.at(tok);
+            bstack.push_back(
+                    [blhs, kernel, anomalies, idx](size_t off, size_t n,
+                        double* out){
+                    blhs(off, n, out);
+                    if(kernel(n, out, anomalies->check))
+                        markbad(*anomalies, idx, n, out);
+                    });
+
+        } else if(PRIORITY.count(tok)) {
+            return PARSE_ERROR("Unexpected operator: "+tok, *pit);
         } else {
             function<double()> foo;
             char* end = NULL;
@@ -167,9 +617,22 @@ MathExpression::MathExpression(string eq, bool rpn)
 #endif
                     return v;
                 };
-            } else if(args.count(tok) > 0) {
+                bool finite = std::isfinite(v);
+                bstack.push_back([v, finite, anomalies, idx](size_t, size_t n,
+                            double* out) {
+                        std::fill(out, out+n, v);
+                        if(!finite && anomalies->check)
+                            markbad(*anomalies, idx, n, out);
+                        });
+            } else {
+                if(newargs.count(tok) == 0) {
+                    // need to create it
+                    newargs[tok].reset(new double);
+                    newcolumns[tok].reset(new const double*(NULL));
+                }
+
                 // bind this
-                auto tmp = args[tok];
+                auto tmp = newargs[tok];
 #ifdef VERYDEBUG
                 cerr << "tok=" << tmp << endl;
 #endif
@@ -180,26 +643,42 @@ MathExpression::MathExpression(string eq, bool rpn)
 #endif
                     return *tmp;
                 };
-            } else {
-                // need to create it
-                args[tok].reset(new double);
-                auto tmp = args[tok];
-#ifdef VERYDEBUG
-                cerr << "new tok=" << tmp << endl;
-#endif
-                foo = [tmp, tok]()
-                {
-#ifdef VERYDEBUG
-                    cerr << tok << " " << tmp << " " << *tmp << endl;
-#endif
-                    return *tmp;
-                };
+                auto col = newcolumns[tok];
+                bstack.push_back([col, anomalies, idx](size_t off, size_t n,
+                            double* out) {
+                        const double* in = *col+off;
+                        if(!anomalies->check) {
+                            std::copy(in, in+n, out);
+                            return;
+                        }
+
+                        int bad = 0;
+                        for(size_t ii=0; ii<n; ii++) {
+                            out[ii] = in[ii];
+                            bad |= (in[ii]-in[ii] != 0);
+                        }
+                        if(bad)
+                            markbad(*anomalies, idx, n, out);
+                        });
             }
             stack.push_back(foo);
+            starts.push_back(idx);
         }
     }
 
+    if(stack.empty())
+        return PARSE_ERROR("Empty expression", 0);
+    if(stack.size() != 1)
+        return PARSE_ERROR("Extra Arguments Left on Stack", pos.back());
+
+    args.swap(newargs);
+    columns.swap(newcolumns);
+    m_anomalies = anomalies;
+    m_rpn.swap(rpn);
+    m_rpnpos.swap(pos);
     executor = stack.back();
+    blockexecutor = bstack.back();
+    return 0;
 }
 
 /**
@@ -249,13 +728,114 @@ int MathExpression::getarg(char arg, double& val)
 /**
  * @brief Performs the expression and returns the result
  *
- * @return
+ * @return result, NaN if nothing is compiled
  */
 double MathExpression::exec()
 {
+    if(!executor)
+        return NAN;
     return executor();
 }
 
+/**
+ * @brief Sets the column of values for a named argument, used by the batch
+ * version of exec(). The column is not copied, so it must remain valid until
+ * exec() returns.
+ *
+ * @param arg Set an arg column
+ * @param vals Pointer to the first row of the column
+ *
+ * @return error if != 0
+ */
+int MathExpression::setcolumn(char arg, const double* vals)
+{
+    string c = " ";
+    c[0] = arg;
+    auto it = columns.find(c);
+    if(it == columns.end())
+        return -1;
+    *it->second = vals;
+
+    return 0;
+}
+
+/**
+ * @brief Performs the expression for every row of the columns set by
+ * setcolumn(), in blocks of rows so that the inner loops vectorize.
+ *
+ * @param rows Number of rows to compute
+ * @param out Output, rows long
+ * @param anomalies If not NULL, filled with the rows that produced non-finite
+ * values
+ *
+ * @return error if != 0 (nothing is compiled or an argument has no column)
+ */
+int MathExpression::exec(size_t rows, double* out, Anomalies* anomalies)
+{
+    if(!blockexecutor)
+        return -1;
+    for(auto it = columns.begin(); it != columns.end(); ++it) {
+        if(*it->second == NULL)
+            return -1;
+    }
+
+    if(!anomalies) {
+        for(size_t off = 0; off < rows; off += BLOCKSIZE)
+            blockexecutor(off, min(BLOCKSIZE, rows-off), out+off);
+        return 0;
+    }
+
+    // firstbad is only scanned and reset for blocks with a marked row
+    anomalies->rows.assign((rows+63)/64, 0);
+    anomalies->first.clear();
+    BlockAnomalies& st = *m_anomalies;
+    st.check = true;
+    st.marked = false;
+    st.firstbad.assign(BLOCKSIZE, -1);
+    for(size_t off = 0; off < rows; off += BLOCKSIZE) {
+        size_t n = min(BLOCKSIZE, rows-off);
+        blockexecutor(off, n, out+off);
+        if(!st.marked)
+            continue;
+
+        for(size_t ii=0; ii<n; ii++) {
+            if(st.firstbad[ii] >= 0) {
+                anomalies->rows[(off+ii)/64] |= (uint64_t)1 << ((off+ii)%64);
+                anomalies->first.push_back(make_pair(off+ii,
+                            (size_t)st.firstbad[ii]));
+                st.firstbad[ii] = -1;
+            }
+        }
+        st.marked = false;
+    }
+    st.check = false;
+
+    return 0;
+}
+
+/**
+ * @brief Returns a token of the expression in RPN, for instance the token
+ * that caused an anomaly.
+ *
+ * @param ii Index of the token
+ * @param pos If not NULL, set to the offset of the token in the equation
+ *
+ * @return token, empty if ii is out of range
+ */
+string MathExpression::rpntoken(size_t ii, size_t* pos)
+{
+    if(ii >= m_rpn.size())
+        return "";
+
+    auto it = m_rpn.begin();
+    auto pit = m_rpnpos.begin();
+    advance(it, ii);
+    advance(pit, ii);
+    if(pos)
+        *pos = *pit;
+    return *it;
+}
+
 void MathExpression::randomTest()
 {
     cerr << "Equation: ";
@@ -302,10 +882,22 @@ void MathExpression::printInfix()
     list<string> stack;
     for(auto it = m_rpn.begin(); it != m_rpn.end(); it++) {
         string tok = *it;
-        if(BINARY.count(tok))  {
+        if(tok == TERNARY) {
+            if(stack.size() < 3)
+                THROW(INVALID_ARGUMENT("Not Enough Arguments!"));
+            string rhs = stack.back();
+            stack.pop_back();
+            string lhs = stack.back();
+            stack.pop_back();
+            string cond = stack.back();
+            stack.pop_back();
+
+            tok = "(" + cond + "?" + lhs + ":" + rhs + ")";
+            stack.push_back(tok);
+        } else if(BINARY.count(tok))  {
             string lhs, rhs;
             if(stack.size() < 2)
-                throw INVALID_ARGUMENT("Not Enough Arguments!");
+                THROW(INVALID_ARGUMENT("Not Enough Arguments!"));
             rhs = stack.back();
             stack.pop_back();
             lhs = stack.back();
@@ -315,7 +907,7 @@ void MathExpression::printInfix()
             stack.push_back(tok);
         } else if(UNARY.count(tok)) {
             if(stack.size() < 1)
-                throw INVALID_ARGUMENT("Not Enough Arguments!");
+                THROW(INVALID_ARGUMENT("Not Enough Arguments!"));
             tok = tok + "(" + stack.back() + ")";
             stack.pop_back();
             stack.push_back(tok);
@@ -324,7 +916,7 @@ void MathExpression::printInfix()
         }
     }
     if(stack.size() != 1)
-        throw INVALID_ARGUMENT("Extra Arguments Left on Stack");
+        THROW(INVALID_ARGUMENT("Extra Arguments Left on Stack"));
     cerr << "INFIX:" << stack.back() << endl;
 }
 
@@ -333,14 +925,20 @@ void MathExpression::printInfix()
  * @brief Helper function, turns a raw string into tokens
  *
  * @param exp Expression to turn into tokens
+ * @param out Output, list of tokens
+ * @param pos Output, offset in exp of each token
  *
- * @return list of tokens
+ * @return error if != 0
  */
-list<string> MathExpression::tokenize(string exp)
+int MathExpression::tokenize(string exp, list<string>& out,
+        list<size_t>& pos)
 {
+#ifdef VERYDEBUG
     cerr << "MathExpression: " << exp << endl;
+#endif
     bool restart = true; // restart loop
-    list<string> out;
+    out.clear();
+    pos.clear();
     string singlechar = " ";
     for(size_t ii=0; ii<exp.size();) {
         restart = false;
@@ -351,6 +949,7 @@ list<string> MathExpression::tokenize(string exp)
         if(exp[ii] == ')' || exp[ii] == '(') {
             singlechar[0] = exp[ii];
             out.push_back(singlechar);
+            pos.push_back(ii);
             ii++;
             continue;
         }
@@ -359,6 +958,7 @@ list<string> MathExpression::tokenize(string exp)
         for(auto& v : PRIORITY) {
             if(exp.compare(ii, v.first.length(), v.first) == 0) {
                 out.push_back(v.first);
+                pos.push_back(ii);
                 ii += v.first.length();
                 restart = true;
                 break;
@@ -370,6 +970,7 @@ list<string> MathExpression::tokenize(string exp)
         if(isalpha(exp[ii])) {
             singlechar[0] = exp[ii];
             out.push_back(singlechar);
+            pos.push_back(ii);
             ii++;
             continue;
         }
@@ -378,92 +979,135 @@ list<string> MathExpression::tokenize(string exp)
         char* end;
         strtod(&exp.c_str()[ii], &end);
         if(end == &exp.c_str()[ii]) {
-            throw INVALID_ARGUMENT("Unknown character: "+to_string(exp[ii]));
+            return PARSE_ERROR(string("Unknown character '")+exp[ii]+"'", ii);
         } else {
             size_t len = ((end-&exp.c_str()[ii]));
             out.push_back(exp.substr(ii, len));
+            pos.push_back(ii);
             ii += len;
         }
     }
 
-    return out;
+    return 0;
 }
 
 /**
  * @brief Helper function that reorder tokens based on their priority
  * so that infix is turned into RPN.
  *
- * @param list of tokens
+ * @param tokens list of tokens, replaced by the list in RPN
+ * @param pos Offset of each token, reordered along with the tokens
  *
- * @return list of tokens, now in RPN
+ * @return error if != 0
  */
-list<string> MathExpression::infixreorder(list<string> tokens)
+int MathExpression::infixreorder(list<string>& tokens, list<size_t>& pos)
 {
     list<string> opstack;
     list<string> outqueue;
+    list<size_t> oppos;
+    list<size_t> outpos;
     string prev = "";
     bool impliedmult = false;
     bool prevarg = false;
-    for(auto it=tokens.begin(); it != tokens.end(); ++it) {
+
+    auto pushop = [&opstack, &oppos](string op, size_t p) {
+        opstack.push_front(op);
+        oppos.push_front(p);
+    };
+
+    // Conditionals sit on the opstack as "?" until their ':' is found, then
+    // as ":" until they are output as TERNARY
+    auto popop = [this, &opstack, &outqueue, &oppos, &outpos]() -> int {
+        if(opstack.front() == TERNARY)
+            return PARSE_ERROR("Error, '?' without matching ':'", oppos.front());
+        if(opstack.front() == ":")
+            outqueue.push_back(TERNARY);
+        else
+            outqueue.push_back(opstack.front());
+        outpos.push_back(oppos.front());
+        opstack.pop_front();
+        oppos.pop_front();
+        return 0;
+    };
+
+    auto pit = pos.begin();
+    for(auto it=tokens.begin(); it != tokens.end(); ++it, ++pit) {
         string tok = *it;
-        if(impliedmult && tok != ")" && (tok == "(" || BINARY.count(tok) == 0)) {
+        if(impliedmult && tok != ")" && tok != TERNARY && tok != ":" &&
+                (tok == "(" || BINARY.count(tok) == 0)) {
             while(!opstack.empty()) {
                 // Go ahead and evaluate higher PRIORITY operators before
                 // the current
-                if(PRIORITY["*"] <= PRIORITY[opstack.front()]) {
-                    outqueue.push_back(opstack.front());
-                    opstack.pop_front();
+                if(priority("*") <= priority(opstack.front())) {
+                    if(popop() != 0)
+                        return -1;
                 } else {
                     break;
                 }
             }
-            opstack.push_front("*");
+            pushop("*", *pit);
         }
 
         if(tok == "(") {
             // Open Parenthetical
-            opstack.push_front(tok);
+            pushop(tok, *pit);
             impliedmult = false;
             prevarg = false;
         } else if(tok == ")") {
             // Close Parenthetical
-            while(opstack.front() != "(") {
-                outqueue.push_back(opstack.front());
-                opstack.pop_front();
+            while(opstack.empty() || opstack.front() != "(") {
                 if(opstack.empty()) {
-                    throw INVALID_ARGUMENT("Error, closed paren was never "
-                            "opened\n");
+                    return PARSE_ERROR("Error, closed paren was never "
+                            "opened", *pit);
                 }
+                if(popop() != 0)
+                    return -1;
             }
             opstack.pop_front();
+            oppos.pop_front();
             impliedmult = true;
             prevarg = true;
+        } else if(tok == ":") {
+            // Finish the true branch of the innermost open conditional
+            while(opstack.empty() || opstack.front() != TERNARY) {
+                if(opstack.empty() || opstack.front() == "(")
+                    return PARSE_ERROR("Error, ':' without matching '?'", *pit);
+                if(popop() != 0)
+                    return -1;
+            }
+            opstack.front() = ":";
+            impliedmult = false;
+            prevarg = false;
         } else if(PRIORITY.count(tok) > 0) {
             // check for prefix +-
             if(!prevarg && tok == "+") {
                 // ignore + prefix
             } else if(!prevarg && tok == "-") {
                 // prefix negate has highest PRIORITY
-                opstack.push_front("neg");
+                pushop("neg", *pit);
             } else {
-                // Add latest operator to stack until we find lower PRIORITY op
+                // Add latest operator to stack until we find lower PRIORITY
+                // op, conditionals are right associative
                 while(!opstack.empty()) {
                     // Go ahead and evaluate higher PRIORITY operators before
                     // the current
-                    if(PRIORITY[tok] <= PRIORITY[opstack.front()]) {
-                        outqueue.push_back(opstack.front());
-                        opstack.pop_front();
+                    if(priority(tok) < priority(opstack.front()) ||
+                            (tok != TERNARY &&
+                             priority(tok) == priority(opstack.front()))) {
+                        if(popop() != 0)
+                            return -1;
                     } else {
                         break;
                     }
                 }
-                opstack.push_front(tok);
+                pushop(tok, *pit);
             }
             impliedmult = false;
             prevarg = false;
         } else {
             // argument
             outqueue.push_back(tok);
+            outpos.push_back(*pit);
 
             impliedmult = true;
             prevarg = true;
@@ -473,11 +1117,13 @@ list<string> MathExpression::infixreorder(list<string> tokens)
     // Copy last operators to output queue
     while(!opstack.empty()) {
         if(opstack.front() == "(")
-            throw INVALID_ARGUMENT("Error, unmatched parentheses remaining");
-        outqueue.push_back(opstack.front());
-        opstack.pop_front();
+            return PARSE_ERROR("Error, unmatched parentheses remaining",
+                    oppos.front());
+        if(popop() != 0)
+            return -1;
     }
 
-    return outqueue;
+    tokens = outqueue;
+    pos = outpos;
+    return 0;
 }
-
@@ -18,11 +18,93 @@
  *
  *****************************************************************************/
 
+#ifndef MATHEXPRESSION_H
+#define MATHEXPRESSION_H
+
 #include <unordered_map>
 #include <string>
 #include <memory>
 #include <functional>
 #include <list>
+#include <vector>
+#include <cstddef>
+#include <stdexcept>
+#include <cstdint>
+#include <utility>
+
+/**
+ * @brief Exception for malformed expressions, pos is the offset of the
+ * offending token in the expression string.
+ */
+class ParseError : public std::invalid_argument
+{
+public:
+    ParseError(const std::string& what, size_t pos) :
+        std::invalid_argument(what), pos(pos)
+    {};
+
+    size_t pos;
+};
+
+class MathExpression;
+struct BlockAnomalies;
+
+/**
+ * @brief Rows of a batch exec() that produced a non-finite value (NaN or
+ * Inf), for instance from dividing by zero or the log of a negative.
+ */
+struct Anomalies
+{
+    /**
+     * @brief Bit ii%64 of rows[ii/64] is set if row ii had an anomaly
+     */
+    std::vector<uint64_t> rows;
+
+    /**
+     * @brief For each row with an anomaly, in order, the row and the index
+     * in the RPN of the token that first produced a non-finite value. This
+     * is an argument if the input itself was not finite. See rpntoken().
+     */
+    std::vector<std::pair<size_t, size_t>> first;
+};
+
+/**
+ * @brief Result of compiling one expression with MathExpression::compile_all
+ */
+struct CompileResult
+{
+    /**
+     * @brief Compiled expression, NULL if there was an error
+     */
+    std::shared_ptr<MathExpression> expr;
+
+    /**
+     * @brief Error message, empty on success
+     */
+    std::string error;
+
+    /**
+     * @brief Offset in the expression string of the error
+     */
+    size_t pos;
+};
+
+/**
+ * @brief Timing of MathExpression::compile_all in seconds. Stage times are
+ * summed over all threads, so they may add up to more than total.
+ */
+struct CompileStats
+{
+    double total;
+    double tokenize;
+    double reorder;
+    double build;
+
+    /**
+     * @brief Number of expressions that failed to compile
+     */
+    size_t failed;
+};
 
 /**
  * @brief Class for parsing and evaluating math equations from text.
@@ -32,7 +114,9 @@ class MathExpression
 public:
 
     /**
-     * @brief Constructor.
+     * @brief Constructor. Throws ParseError if eq can't be parsed; when
+     * building without exceptions a failed parse is only visible through
+     * error(), and the expression is left empty.
      *
      * @param eq String represntation of equation. Infix format unless rpn is
      * true 
@@ -41,6 +125,57 @@ public:
      */
     MathExpression(std::string eq, bool rpn = false);
 
+    /**
+     * @brief Empty expression, use compile() to fill it in
+     */
+    MathExpression();
+
+    /**
+     * @brief Parses and compiles eq into this expression without throwing,
+     * for use when building with -fno-exceptions.
+     *
+     * @param eq String represntation of equation. Infix format unless rpn is
+     * true
+     * @param rpn if true, then the equation is assumed to be
+     * Reverse-Polish-Notation
+     *
+     * @return error if != 0, see error() and errorpos()
+     */
+    int compile(std::string eq, bool rpn = false);
+
+    /**
+     * @brief Error message from the last compile(), empty if there was none
+     */
+    const std::string& error() const
+    {
+        return m_error;
+    };
+
+    /**
+     * @brief Offset in the equation of the error from the last compile()
+     */
+    size_t errorpos() const
+    {
+        return m_errorpos;
+    };
+
+    /**
+     * @brief Parses and compiles many expressions in parallel. Errors are
+     * returned for each expression rather than thrown, so a bad expression
+     * does not stop the others.
+     *
+     * @param eqs Equations to compile
+     * @param threads Number of threads to use, 0 for the hardware concurrency
+     * @param stats If not NULL, filled with the time spent in each stage
+     * @param rpn if true, then the equations are assumed to be
+     * Reverse-Polish-Notation
+     *
+     * @return One result for each equation, in the same order
+     */
+    static std::vector<CompileResult> compile_all(
+            const std::vector<std::string>& eqs, unsigned threads,
+            CompileStats* stats = NULL, bool rpn = false);
+
     /**
      * @brief Sets variable (argument in the math equation
      *
@@ -62,13 +197,50 @@ public:
      */
     int getarg(char arg, double& val);
 
+    /**
+     * @brief Sets the column of values for a named argument, used by the
+     * batch version of exec(). The column is not copied, so it must remain
+     * valid until exec() returns.
+     *
+     * @param arg Set an arg column
+     * @param vals Pointer to the first row of the column
+     *
+     * @return error if != 0
+     */
+    int setcolumn(char arg, const double* vals);
+
     /**
      * @brief Performs the expression and returns the result
      *
-     * @return 
+     * @return result, NaN if nothing is compiled
      */
     double exec();
 
+    /**
+     * @brief Performs the expression for every row of the columns set by
+     * setcolumn(), in blocks of rows so that the inner loops vectorize.
+     *
+     * @param rows Number of rows to compute
+     * @param out Output, rows long
+     * @param anomalies If not NULL, filled with the rows that produced
+     * non-finite values
+     *
+     * @return error if != 0 (nothing is compiled or an argument has no
+     * column)
+     */
+    int exec(size_t rows, double* out, Anomalies* anomalies = NULL);
+
+    /**
+     * @brief Returns a token of the expression in RPN, for instance the
+     * token that caused an anomaly.
+     *
+     * @param ii Index of the token
+     * @param pos If not NULL, set to the offset of the token in the equation
+     *
+     * @return token, empty if ii is out of range
+     */
+    std::string rpntoken(size_t ii, size_t* pos = NULL);
+
     /**
      * @brief Print the expression as infix
      */
@@ -140,31 +312,86 @@ private:
      * @brief Helper function, turns a raw string into tokens
      *
      * @param exp Expression to turn into tokens
+     * @param tokens Output, list of tokens
+     * @param pos Output, offset in exp of each token
      *
-     * @return list of tokens
+     * @return error if != 0
      */
-    std::list<std::string> tokenize(std::string exp);
+    int tokenize(std::string exp, std::list<std::string>& tokens,
+            std::list<size_t>& pos);
 
     /**
      * @brief Helper function that reorder tokens based on their priority
      * so that infix is turned into RPN.
      *
-     * @param list of tokens
+     * @param tokens list of tokens, replaced by the list in RPN
+     * @param pos Offset of each token, reordered along with the tokens
+     *
+     * @return error if != 0
+     */
+    int infixreorder(std::list<std::string>& tokens, std::list<size_t>& pos);
+
+    /**
+     * @brief Helper function that builds the executors from an expression in
+     * RPN. The expression is only replaced if this succeeds.
+     *
+     * @param rpn Tokens in RPN, moved into m_rpn on success
+     * @param pos Offset of each token, moved into m_rpnpos on success
+     *
+     * @return error if != 0
+     */
+    int build(std::list<std::string>& rpn, std::list<size_t>& pos);
+
+    /**
+     * @brief Records an error for error() and errorpos()
      *
-     * @return list of tokens, now in RPN
+     * @return -1, so that it can be returned
      */
-    std::list<std::string> infixreorder(std::list<std::string> exp);
+    int fail(std::string msg, size_t pos);
 
     /**
      * @brief Function that  calls math equations
      */
     std::function<double()> executor;
 
+    /**
+     * @brief Columns for the variables, used by the batch exec()
+     */
+    std::unordered_map<std::string, std::shared_ptr<const double*>> columns;
+
+    /**
+     * @brief Function that computes math equations over a block of rows,
+     * arguments are the first row, number of rows and output.
+     */
+    std::function<void(size_t, size_t, double*)> blockexecutor;
+
+    /**
+     * @brief Anomalies of the current block, shared with the block functions
+     * and only filled in when the batch exec() is tracking them.
+     */
+    std::shared_ptr<BlockAnomalies> m_anomalies;
+
     /**
      * @brief MathExpression stored in RPN format. Mostly just for printing.
      */
     std::list<std::string> m_rpn;
 
+    /**
+     * @brief Offset in the original string of each token in m_rpn, for
+     * error messages.
+     */
+    std::list<size_t> m_rpnpos;
+
+    /**
+     * @brief Error from the last compile()
+     */
+    std::string m_error;
+
+    /**
+     * @brief Offset of the error from the last compile()
+     */
+    size_t m_errorpos;
+
 };
 
 
@@ -173,3 +400,4 @@ private:
  */
 void listops();
 
+#endif // MATHEXPRESSION_H
@@ -0,0 +1,246 @@
+/******************************************************************************
+ * Copyright 2014 Micah C Chambers (micahc.vt@gmail.com)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * @file sharedbatch.cpp Evaluates a MathExpression over large batches of rows
+ * in forked worker processes that share memory.
+ *
+ *****************************************************************************/
+
+#include "sharedbatch.h"
+
+#include <string>
+#include <atomic>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cerrno>
+#include <new>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+// atomic<uint64_t> is atomic<unsigned long> on LP64 and atomic<unsigned long
+// long> elsewhere, so check whichever one it is
+static_assert((sizeof(long) == sizeof(uint64_t) ? ATOMIC_LONG_LOCK_FREE :
+            ATOMIC_LLONG_LOCK_FREE) == 2 && ATOMIC_CHAR_LOCK_FREE == 2,
+        "SharedBatch needs address-free atomics to share them between "
+        "processes");
+
+// Microseconds between progress callbacks
+const useconds_t POLLUS = 10000;
+
+// Shard states
+const uint8_t SHARD_TODO = 0;
+const uint8_t SHARD_DONE = 1;
+
+/*
+ * Start of the shared region. Workers claim the next shard by incrementing
+ * next, and add to rowsdone when they finish one.
+ */
+struct Control
+{
+    atomic<uint64_t> next;
+    atomic<uint64_t> rowsdone;
+};
+
+// Round up to a cache line so columns don't share lines
+static size_t align64(size_t off)
+{
+    return (off + 63) & ~(size_t)63;
+}
+
+/**
+ * @brief Constructor, maps the shared region with a column for each argument
+ * of expr.
+ *
+ * @param expr Expression to evaluate, must outlive the batch
+ * @param rows Number of rows
+ * @param shardrows Number of rows in each shard
+ */
+SharedBatch::SharedBatch(MathExpression& expr, size_t rows,
+        size_t shardrows) : m_expr(expr), m_rows(rows),
+    m_shardrows(max(shardrows, (size_t)1))
+{
+    for(auto it = expr.begin(); it != expr.end(); ++it)
+        m_args += it->first;
+    sort(m_args.begin(), m_args.end());
+
+    m_nshards = (m_rows + m_shardrows - 1)/m_shardrows;
+    m_statesoff = align64(sizeof(Control));
+    m_columnsoff = align64(m_statesoff + m_nshards);
+    m_size = m_columnsoff + align64(m_rows*sizeof(double))*(m_args.size()+1);
+
+    // on failure the columns are NULL and exec() returns an error
+    m_region = mmap(NULL, m_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(m_region == MAP_FAILED) {
+        m_region = NULL;
+        return;
+    }
+
+    new (m_region) Control();
+}
+
+/**
+ * @brief Destructor, unmaps the shared region
+ */
+SharedBatch::~SharedBatch()
+{
+    if(!m_region)
+        return;
+    ((Control*)m_region)->~Control();
+    munmap(m_region, m_size);
+}
+
+/**
+ * @brief Returns the column for an argument, to fill before exec()
+ *
+ * @param arg Argument to get the column of
+ *
+ * @return column, rows long, or NULL if arg is not in the expression
+ */
+double* SharedBatch::column(char arg)
+{
+    size_t ii = m_args.find(arg);
+    if(!m_region || ii == string::npos)
+        return NULL;
+
+    return (double*)((char*)m_region + m_columnsoff +
+            align64(m_rows*sizeof(double))*ii);
+}
+
+/**
+ * @brief Returns the output column, filled by exec()
+ *
+ * @return output, rows long
+ */
+double* SharedBatch::output()
+{
+    if(!m_region)
+        return NULL;
+    return (double*)((char*)m_region + m_columnsoff +
+            align64(m_rows*sizeof(double))*m_args.size());
+}
+
+/**
+ * @brief Number of rows finished by the last exec(), may be called while
+ * exec() is running.
+ */
+size_t SharedBatch::rowsdone()
+{
+    if(!m_region)
+        return 0;
+    return ((Control*)m_region)->rowsdone.load(memory_order_acquire);
+}
+
+/**
+ * @brief Evaluates shards until there are none left, in a worker
+ *
+ * @return error if != 0, the shard that failed is left not done
+ */
+int SharedBatch::work()
+{
+    Control* ctl = (Control*)m_region;
+    auto states = (atomic<uint8_t>*)((char*)m_region + m_statesoff);
+    double* out = output();
+    for(size_t shard = ctl->next++; shard < m_nshards; shard = ctl->next++) {
+        size_t off = shard*m_shardrows;
+        size_t n = min(m_shardrows, m_rows-off);
+        for(auto arg : m_args)
+            m_expr.setcolumn(arg, column(arg)+off);
+        if(m_expr.exec(n, out+off) != 0)
+            return -1;
+
+        states[shard].store(SHARD_DONE, memory_order_release);
+        ctl->rowsdone.fetch_add(n, memory_order_release);
+    }
+    return 0;
+}
+
+/**
+ * @brief Forks workers that evaluate all the shards, then waits for them.
+ *
+ * @param workers Number of worker processes
+ * @param progress If set, called periodically with the number of rows done
+ * while waiting
+ *
+ * @return error if != 0 (a worker failed or could not be started). Rows of
+ * shards that were not finished are set to NaN.
+ */
+int SharedBatch::exec(unsigned workers, function<void(size_t)> progress)
+{
+    if(!m_region)
+        return -1;
+
+    Control* ctl = (Control*)m_region;
+    auto states = (atomic<uint8_t>*)((char*)m_region + m_statesoff);
+    ctl->next = 0;
+    ctl->rowsdone = 0;
+    for(size_t ii = 0; ii < m_nshards; ii++)
+        states[ii].store(SHARD_TODO, memory_order_relaxed);
+
+    int ret = 0;
+    vector<pid_t> pids;
+    for(unsigned ww = 0; ww < max(workers, 1u); ww++) {
+        pid_t pid = fork();
+        if(pid == 0) {
+            // worker, _exit so that the parent's buffers aren't flushed twice
+            _exit(work() == 0 ? 0 : 1);
+        } else if(pid < 0) {
+            ret = -1;
+            break;
+        }
+        pids.push_back(pid);
+    }
+
+    // Only wait on our own workers, the caller may have other children
+    while(!pids.empty()) {
+        int status;
+        pid_t pid = waitpid(pids.back(), &status, progress ? WNOHANG : 0);
+        if(pid == 0) {
+            progress(rowsdone());
+            usleep(POLLUS);
+            continue;
+        } else if(pid < 0) {
+            if(errno == EINTR)
+                continue;
+            ret = -1;
+            break;
+        }
+
+        pids.pop_back();
+        if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            ret = -1;
+    }
+    if(progress)
+        progress(rowsdone());
+
+    // Shards of workers that died, or that no worker got to
+    double* out = output();
+    for(size_t ii = 0; ii < m_nshards; ii++) {
+        if(states[ii].load(memory_order_acquire) != SHARD_DONE) {
+            size_t off = ii*m_shardrows;
+            fill(out+off, out+min(off+m_shardrows, m_rows), NAN);
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
@@ -0,0 +1,128 @@
+/******************************************************************************
+ * Copyright 2014 Micah C Chambers (micahc.vt@gmail.com)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * @file sharedbatch.h Evaluates a MathExpression over large batches of rows
+ * in forked worker processes that share memory.
+ *
+ *****************************************************************************/
+
+#ifndef SHAREDBATCH_H
+#define SHAREDBATCH_H
+
+#include "mathexpression.h"
+
+#include <string>
+#include <functional>
+#include <cstddef>
+
+/**
+ * @brief Input and output columns for a MathExpression in a shared memory
+ * region, evaluated in shards of rows by forked worker processes. Workers
+ * claim shards and report progress through lock-free counters in the same
+ * region, so a worker that crashes only loses its own shard.
+ */
+class SharedBatch
+{
+public:
+
+    /**
+     * @brief Constructor, maps the shared region with a column for each
+     * argument of expr. If that fails column() and output() return NULL.
+     *
+     * @param expr Expression to evaluate, must outlive the batch
+     * @param rows Number of rows
+     * @param shardrows Number of rows in each shard
+     */
+    SharedBatch(MathExpression& expr, size_t rows, size_t shardrows = 65536);
+
+    /**
+     * @brief Destructor, unmaps the shared region
+     */
+    ~SharedBatch();
+
+    /**
+     * @brief Returns the column for an argument, to fill before exec()
+     *
+     * @param arg Argument to get the column of
+     *
+     * @return column, rows long, or NULL if arg is not in the expression
+     */
+    double* column(char arg);
+
+    /**
+     * @brief Returns the output column, filled by exec()
+     *
+     * @return output, rows long
+     */
+    double* output();
+
+    /**
+     * @brief Forks workers that evaluate all the shards, then waits for them.
+     *
+     * @param workers Number of worker processes
+     * @param progress If set, called periodically with the number of rows
+     * done while waiting
+     *
+     * @return error if != 0 (a worker failed or could not be started). Rows
+     * of shards that were not finished are set to NaN.
+     */
+    int exec(unsigned workers,
+            std::function<void(size_t)> progress = nullptr);
+
+    /**
+     * @brief Number of rows finished by the last exec(), may be called while
+     * exec() is running.
+     */
+    size_t rowsdone();
+
+private:
+    SharedBatch(const SharedBatch&) = delete;
+    SharedBatch& operator=(const SharedBatch&) = delete;
+
+    /**
+     * @brief Evaluates shards until there are none left, in a worker
+     *
+     * @return error if != 0, the shard that failed is left not done
+     */
+    int work();
+
+    /**
+     * @brief Expression to evaluate, shared with the workers by fork
+     */
+    MathExpression& m_expr;
+
+    size_t m_rows;
+    size_t m_shardrows;
+    size_t m_nshards;
+
+    /**
+     * @brief Arguments of the expression, in the order of the columns
+     */
+    std::string m_args;
+
+    /**
+     * @brief Shared region, control block then shard states then columns
+     */
+    void* m_region;
+    size_t m_size;
+
+    /**
+     * @brief Offsets in the region of the shard states and first column
+     */
+    size_t m_statesoff;
+    size_t m_columnsoff;
+};
+
+#endif // SHAREDBATCH_H
@@ -19,14 +19,17 @@
 
 #include <iostream>
 #include <cmath>
+#include <vector>
+#include <string>
 #include "mathexpression.h"
+#include "sharedbatch.h"
 
 using namespace std;
 
 int main()
 {
     {
-        MathExpression func("3*3^32/1.e-3", true);
+        MathExpression func("3*3^32/1.e-3", false);
         func.printInfix();
         func.printRPN();
         func.printPN();
@@ -37,7 +40,7 @@ int main()
         }
     }
     {
-        MathExpression func("3*3^-32/1.e-3", true);
+        MathExpression func("3*3^-32/1.e-3", false);
         func.printInfix();
         func.printRPN();
         func.printPN();
@@ -48,7 +51,7 @@ int main()
         }
     }
     {
-        MathExpression func("3-3e5-1*5/1.e-3", true);
+        MathExpression func("3-3e5-1*5/1.e-3", false);
         func.printInfix();
         func.printRPN();
         func.printPN();
@@ -58,7 +61,169 @@ int main()
             return -1;
         }
     }
-    
+    {
+        MathExpression func("x<0 ? -x : x<1 ? 2 : 3*x", false);
+        func.printInfix();
+        func.printRPN();
+        func.printPN();
+
+        double xs[] = {-5, -1, 0, .5, 1, 7};
+        double out[6];
+        func.setcolumn('x', xs);
+        if(func.exec(6, out) != 0) {
+            cerr << "ERROR!" << endl;
+            return -1;
+        }
+        for(int ii=0; ii<6; ii++) {
+            double x = xs[ii];
+            double expected = x<0 ? -x : x<1 ? 2 : 3*x;
+            func.setarg('x', x);
+            if(func.exec() != expected || out[ii] != expected) {
+                cerr << "ERROR!" << endl;
+                return -1;
+            }
+        }
+    }
+    {
+        MathExpression func("(x>0 & y>0) | x==-1", false);
+        func.printInfix();
+        func.printRPN();
+        func.printPN();
+
+        double xs[] = {1, 1, -1, -2, 0};
+        double ys[] = {1, -1, -1, 5, 1};
+        double out[5];
+        func.setcolumn('x', xs);
+        func.setcolumn('y', ys);
+        if(func.exec(5, out) != 0) {
+            cerr << "ERROR!" << endl;
+            return -1;
+        }
+        for(int ii=0; ii<5; ii++) {
+            double expected = (xs[ii]>0 && ys[ii]>0) || xs[ii]==-1;
+            func.setarg('x', xs[ii]);
+            func.setarg('y', ys[ii]);
+            if(func.exec() != expected || out[ii] != expected) {
+                cerr << "ERROR!" << endl;
+                return -1;
+            }
+        }
+    }
+    {
+        vector<string> eqs({"x<0 ? -x : 2*x", "x + (y*", "3 $ x", "x*y"});
+        CompileStats stats;
+        auto res = MathExpression::compile_all(eqs, 2, &stats);
+        if(res.size() != 4 || stats.failed != 2 || !res[0].expr ||
+                !res[3].expr || res[1].expr || res[2].expr ||
+                res[1].pos != 4 || res[2].pos != 2 ||
+                res[2].error != "Unknown character '$'") {
+            cerr << "ERROR!" << endl;
+            return -1;
+        }
+        cerr << res[1].error << endl;
+        cerr << res[2].error << endl;
+
+        res[0].expr->setarg('x', -3);
+        if(res[0].expr->exec() != 3) {
+            cerr << "ERROR!" << endl;
+            return -1;
+        }
+    }
+    {
+        MathExpression func;
+        if(func.compile("x + (y") == 0 || func.errorpos() != 4) {
+            cerr << "ERROR!" << endl;
+            return -1;
+        }
+        cerr << func.error() << endl;
+
+        if(func.compile("x<0 ? log(-x) : log(x) + 1/y") != 0) {
+            cerr << "ERROR!" << endl;
+            return -1;
+        }
+        func.printRPN();
+
+        double xs[] = {-1, 2, 0, 3};
+        double ys[] = {1, 0, 1, 1};
+        double out[4];
+        Anomalies anomalies;
+        func.setcolumn('x', xs);
+        func.setcolumn('y', ys);
+        if(func.exec(4, out, &anomalies) != 0 || anomalies.rows.size() != 1 ||
+                anomalies.rows[0] != 6 || anomalies.first.size() != 2 ||
+                func.rpntoken(anomalies.first[0].second) != "/" ||
+                func.rpntoken(anomalies.first[1].second) != "log") {
+            cerr << "ERROR!" << endl;
+            return -1;
+        }
+    }
+    {
+        // nothing compiled yet
+        MathExpression func;
+        double out[4];
+        Anomalies anomalies;
+        if(func.exec(0, out, &anomalies) == 0 || func.exec(4, out) == 0 ||
+                !std::isnan(func.exec()) || func.compile("x +") == 0 ||
+                func.exec(4, out) == 0 || !std::isnan(func.exec())) {
+            cerr << "ERROR!" << endl;
+            return -1;
+        }
+    }
+    {
+        // a failed recompile keeps the previous expression
+        MathExpression func;
+        if(func.compile("y z +", true) != 0 ||
+                func.compile("y 2 3 +", true) == 0) {
+            cerr << "ERROR!" << endl;
+            return -1;
+        }
+        cerr << func.error() << endl;
+
+        double ys[] = {1, 2};
+        double zs[] = {3, 4};
+        double out[2];
+        if(func.setarg('y', 2) != 0 || func.setarg('z', 3) != 0 ||
+                func.exec() != 5 || func.rpntoken(2) != "+" ||
+                func.setcolumn('y', ys) != 0 || func.setcolumn('z', zs) != 0 ||
+                func.exec(2, out) != 0 || out[0] != 4 || out[1] != 6) {
+            cerr << "ERROR!" << endl;
+            return -1;
+        }
+    }
+    {
+        MathExpression func("x*y + (x<0 ? -x : 2*x)", false);
+        SharedBatch batch(func, 1000, 64);
+        double* x = batch.column('x');
+        double* y = batch.column('y');
+        for(int ii=0; ii<1000; ii++) {
+            x[ii] = ii-500;
+            y[ii] = ii%3;
+        }
+
+        if(batch.exec(3) != 0 || batch.rowsdone() != 1000) {
+            cerr << "ERROR!" << endl;
+            return -1;
+        }
+        double* out = batch.output();
+        for(int ii=0; ii<1000; ii++) {
+            if(out[ii] != x[ii]*y[ii] + (x[ii]<0 ? -x[ii] : 2*x[ii])) {
+                cerr << "ERROR!" << endl;
+                return -1;
+            }
+        }
+    }
+    {
+        // workers whose exec() fails leave their shards as NaN
+        MathExpression func;
+        SharedBatch batch(func, 100, 64);
+        if(batch.exec(2) == 0 || batch.rowsdone() != 0 ||
+                !std::isnan(batch.output()[0]) ||
+                !std::isnan(batch.output()[99])) {
+            cerr << "ERROR!" << endl;
+            return -1;
+        }
+    }
+
     return 0;
 }
 